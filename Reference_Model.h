@@ -0,0 +1,122 @@
+// Cycle-accurate C++ model of the SAP1, driven entirely by the microcode in
+// Opcode_Table.h (generated from opcodes.rb). It knows nothing about
+// particular instructions -- only what each control line does to the
+// datapath, the same way Top.v does -- so it can serve as an independent
+// reference for the RTL (see Verify.cpp), and as a fast stand in for it
+// when simulating many programs (see Superopt.cpp).
+
+#ifndef REFERENCE_MODEL_H
+#define REFERENCE_MODEL_H
+
+#include "Opcode_Table.h"
+
+#include <cstdint>
+#include <cstring>
+
+// Must match the parameter defaults in Top.v
+static constexpr int          RAM_DEPTH      = 16;
+static constexpr int          ARG_BITS       = 4;
+static constexpr std::uint8_t ADDRESS_MASK   = RAM_DEPTH - 1;
+static constexpr std::uint8_t ARGUMENT_MASK  = (1 << ARG_BITS) - 1;
+
+struct Sap1_State
+{
+    std::uint8_t pc;   // program counter
+    std::uint8_t step; // instruction counter
+    std::uint8_t ir;   // instruction register
+    std::uint8_t mar;  // memory address register
+    std::uint8_t a;
+    std::uint8_t b;
+    std::uint8_t out;
+    bool         zero;
+    bool         carry;
+    bool         odd;
+    std::uint8_t ram[RAM_DEPTH];
+
+    bool operator==(const Sap1_State &o) const
+    {
+        return pc   == o.pc   && step  == o.step  && ir  == o.ir  && mar == o.mar &&
+               a    == o.a    && b     == o.b     && out == o.out &&
+               zero == o.zero && carry == o.carry && odd == o.odd &&
+               std::memcmp(ram, o.ram, sizeof(ram)) == 0;
+    }
+    bool operator!=(const Sap1_State &o) const { return !(*this == o); }
+};
+
+// Everything the decoder asserts for the current step, conditional lines
+// included.
+static inline std::uint32_t control_word(const Sap1_State &s)
+{
+    const Micro_Step &m = lookup_opcode(s.ir >> ARG_BITS).steps[s.step];
+    const bool flag = m.cond_flag == FLAG_ZERO  ? s.zero  :
+                      m.cond_flag == FLAG_CARRY ? s.carry :
+                      m.cond_flag == FLAG_ODD   ? s.odd   : false;
+    return m.ctrl | (flag ? m.cond_ctrl : 0);
+}
+
+// 9 bits wide -- bit 8 is the carry out
+static inline unsigned alu_result(const Sap1_State &s, std::uint32_t cw)
+{
+    return (cw & CW_SU) ? unsigned(s.a) - unsigned(s.b) : unsigned(s.a) + unsigned(s.b);
+}
+
+static inline std::uint8_t bus(const Sap1_State &s, std::uint32_t cw)
+{
+    unsigned v = 0;
+    if (cw & CW_AO) v |= s.a;
+    if (cw & CW_EO) v |= alu_result(s, cw) & 0xff;
+    if (cw & CW_RO) v |= s.ram[s.mar];
+    if (cw & CW_IO) v |= s.ir & ARGUMENT_MASK;
+    if (cw & CW_CO) v |= s.pc;
+    return static_cast<std::uint8_t>(v);
+}
+
+// One posedge with control word cw asserted. Everything samples the values
+// from before the edge, just like the nonblocking assigns in the RTL.
+static inline void clock_edge(Sap1_State &s, std::uint32_t cw)
+{
+    const std::uint8_t d   = bus(s, cw);
+    const unsigned     alu = alu_result(s, cw);
+
+    if (!(cw & CW_HLT))
+    {
+        s.pc   = (cw & CW_J)  ? (d & ADDRESS_MASK) :
+                 (cw & CW_CE) ? ((s.pc + 1) & ADDRESS_MASK) : s.pc;
+        s.step = ((cw & CW_ADV) || s.step == INSTRUCTION_STEPS - 1) ? 0 : s.step + 1;
+    }
+    if (cw & CW_RI) s.ram[s.mar] = d;
+    if (cw & CW_MI) s.mar = d & ADDRESS_MASK;
+    if (cw & CW_II) s.ir  = d;
+    if (cw & CW_AI) s.a   = d;
+    if (cw & CW_BI) s.b   = d;
+    if (cw & CW_OI) s.out = d;
+    if (cw & CW_EL)
+    {
+        s.zero  = (alu & 0xff) == 0;
+        s.carry = (alu >> 8) & 1;
+        s.odd   = alu & 1;
+    }
+}
+
+// Clocks from the current step until the instruction finishes -- the step
+// counter is back at 0 -- or until HLT is asserted, in which case the
+// machine is frozen and never will. Returns the number of clocks taken.
+static inline int run_instruction(Sap1_State &s, bool *halted)
+{
+    int clks = 0;
+    *halted = false;
+    do
+    {
+        const std::uint32_t cw = control_word(s);
+        if (cw & CW_HLT)
+        {
+            *halted = true;
+            break;
+        }
+        clock_edge(s, cw);
+        clks++;
+    } while (s.step != 0);
+    return clks;
+}
+
+#endif
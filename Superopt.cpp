@@ -0,0 +1,599 @@
+// Superoptimizer for SAP1 programs.
+//
+// Runs an assembled program (ram.hex format) on Reference_Model.h to get its
+// Out register sequence, then searches for the smallest program -- or with
+// -c, the fastest one -- that puts out exactly the same sequence and then
+// halts, and writes it out as assembler source.
+//
+// It works in two phases. A greedy local search from the input program
+// (deleting words, rewriting single words) gets quickly to whatever is
+// obviously redundant, even in a full 16 word program. Then an exhaustive
+// search looks for anything better than that -- which finishes for small
+// programs, and otherwise runs until the time limit (-t) runs out.
+//
+// The exhaustive search never enumerates whole RAM images. Each candidate is run as it
+// is built: a word only gets a value once the machine first reads it (as
+// an instruction or as data), and the search branches over every value it
+// could have right there. So a candidate is abandoned the moment it puts
+// out a wrong value, runs out of cycles, or touches RAM outside of the word
+// budget, before any of the words it would have gone on to read are ever
+// chosen. Words that are written before they are read never need a value.
+//
+// The first few branch points are expanded up front into independent sub
+// searches, which are handed out to the worker threads. They share only
+// the best result so far, whose cycle count bounds everyone's search.
+//
+// Every word value tried is one assembler.rb can produce, so whatever is
+// found can always be emitted as source.
+
+#include "Reference_Model.h"
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Same default as MAX_STEPS in Top.cpp -- how long the input program gets
+// to reach its HLT.
+static constexpr std::uint64_t MAX_INPUT_CLKS  = 3500000;
+// Branch points expanded before the workers start. Deep enough to give
+// every thread plenty of sub searches to steal.
+static constexpr int           SPLIT_DEPTH     = 2;
+// How often (in clocks simulated) a worker checks the deadline.
+static constexpr std::uint64_t DEADLINE_CHECK  = 1 << 16;
+// Time limit unless -t says otherwise. The search space grows so fast with
+// the word budget that anything past a handful of words never finishes.
+static constexpr double        DEFAULT_SECONDS = 60.0;
+// How often the search reports its progress within a word budget.
+static constexpr double        REPORT_SECS     = 1.0;
+
+struct Node
+{
+    Sap1_State    s;
+    std::uint8_t  image[RAM_DEPTH]; // initial RAM contents chosen so far
+    std::uint16_t assigned;         // which words of image have been chosen
+    std::uint64_t clks;
+    std::uint32_t outs;             // how much of the Out sequence is matched
+    int           branches;
+};
+
+struct Program
+{
+    std::uint8_t  image[RAM_DEPTH];
+    std::uint64_t clks;
+    bool          found;
+};
+
+struct Search
+{
+    std::vector<std::uint8_t> expected;   // the Out sequence to reproduce
+    int                       words;      // addresses [0, words) may be used
+    std::vector<std::uint8_t> code;       // values a freshly fetched word may take
+    std::vector<std::uint8_t> data;       // values a freshly read data word may take
+
+    std::atomic<std::uint64_t> limit;     // most clks a result may take
+    std::atomic<std::uint64_t> nodes{0};
+    std::atomic<bool>          timed_out{false};
+    std::chrono::steady_clock::time_point deadline;
+    bool                       has_deadline;
+
+    std::mutex                 best_lock;
+    Program                    best;
+};
+
+static bool operand_is_address(const Opcode_Entry &e)
+{
+    for (const Micro_Step &m : e.steps)
+    {
+        for (std::uint32_t cw : {m.ctrl, m.ctrl | m.cond_ctrl})
+            if ((cw & CW_IO) && (cw & (CW_MI | CW_J)))
+                return true;
+    }
+    return false;
+}
+
+// Every byte assembler.rb can emit: instructions with no argument only
+// exist with a zero operand, and opcodes with no mnemonic don't exist at
+// all. For code, operands that are addresses stay inside the word budget.
+static std::vector<std::uint8_t> candidate_values(int words, bool code)
+{
+    std::vector<std::uint8_t> v;
+    for (const Opcode_Entry &e : OPCODE_TABLE)
+    {
+        const int operands = !e.argument ? 1 :
+                             (code && operand_is_address(e)) ? words : (1 << ARG_BITS);
+        for (int arg = 0; arg < operands; arg++)
+            v.push_back((e.opcode << ARG_BITS) | arg);
+    }
+    return v;
+}
+
+// Fewest clocks left before a HLT, if there are still `remaining` values to
+// put out: every one of them needs an OUT, which is at least one more clock
+// for the first and three (fetch + OI) for each after, and then the HLT
+// takes two more to fetch.
+static inline std::uint64_t min_clks_left(std::uint64_t remaining)
+{
+    return remaining == 0 ? 0 : 3 * remaining;
+}
+
+static void offer(Search &se, const Node &n)
+{
+    std::lock_guard<std::mutex> lock(se.best_lock);
+    if (se.best.found && se.best.clks <= n.clks)
+        return;
+    std::copy(n.image, n.image + RAM_DEPTH, se.best.image);
+    se.best.clks  = n.clks;
+    se.best.found = true;
+    // from here on, only strictly faster programs are interesting
+    se.limit = n.clks - 1;
+}
+
+static void run(Search &se, Node n, std::vector<Node> *frontier)
+{
+    // per thread rather than per call, since most calls are short lived
+    static thread_local std::uint64_t since_check = 0;
+
+    // Brent's cycle detection, at instruction boundaries. Nothing between
+    // branch points is left to chance, so coming back around to a state
+    // the machine was already in -- with no more of the Out sequence
+    // matched since -- means it will never halt.
+    Sap1_State    seen      = n.s;
+    std::uint32_t seen_outs = n.outs;
+    std::uint64_t power     = 1;
+    std::uint64_t lambda    = 0;
+
+    for (;;)
+    {
+        if (se.has_deadline && ++since_check == DEADLINE_CHECK)
+        {
+            since_check = 0;
+            if (se.timed_out || std::chrono::steady_clock::now() > se.deadline)
+            {
+                se.timed_out = true;
+                return;
+            }
+        }
+
+        const std::uint32_t cw = control_word(n.s);
+
+        if (cw & (CW_RO | CW_RI))
+        {
+            const std::uint8_t addr = n.s.mar;
+            if (addr >= se.words)
+                return;
+            if (!((n.assigned >> addr) & 1))
+            {
+                if (cw & CW_RI)
+                {
+                    // written before it was ever read, so its initial value
+                    // doesn't matter -- leave it zero (a NOP)
+                    n.assigned |= 1 << addr;
+                }
+                else
+                {
+                    if (frontier != nullptr && n.branches == SPLIT_DEPTH)
+                    {
+                        frontier->push_back(n);
+                        return;
+                    }
+                    // on step 1 this is the instruction fetch
+                    const std::vector<std::uint8_t> &values = n.s.step == 1 ? se.code : se.data;
+                    se.nodes += values.size();
+                    for (std::uint8_t v : values)
+                    {
+                        if (se.timed_out)
+                            return;
+                        Node c = n;
+                        c.image[addr] = v;
+                        c.s.ram[addr] = v;
+                        c.assigned   |= 1 << addr;
+                        c.branches++;
+                        run(se, c, frontier);
+                    }
+                    return;
+                }
+            }
+        }
+
+        if (cw & CW_HLT)
+        {
+            if (n.outs == se.expected.size())
+                offer(se, n);
+            return;
+        }
+
+        if (cw & CW_OI)
+        {
+            if (n.outs == se.expected.size() || se.expected[n.outs] != bus(n.s, cw))
+                return;
+            n.outs++;
+        }
+
+        clock_edge(n.s, cw);
+        n.clks++;
+        if (n.clks + min_clks_left(se.expected.size() - n.outs) > se.limit)
+            return;
+
+        if (n.s.step == 0)
+        {
+            if (n.outs == seen_outs && n.s == seen)
+                return;
+            if (++lambda == power)
+            {
+                seen      = n.s;
+                seen_outs = n.outs;
+                power    *= 2;
+                lambda    = 0;
+            }
+        }
+    }
+}
+
+static void worker(Search &se, const std::vector<Node> &frontier, std::atomic<std::size_t> &next,
+                   std::atomic<std::size_t> &done)
+{
+    std::size_t i;
+    while ((i = next++) < frontier.size() && !se.timed_out)
+    {
+        run(se, frontier[i], nullptr);
+        done++;
+    }
+}
+
+// One complete search with addresses limited to [0, words), for programs
+// taking at most limit clocks.
+static void search(Search &se, int words, std::uint64_t limit, int threads)
+{
+    se.words      = words;
+    se.code       = candidate_values(words, true);
+    se.data       = candidate_values(words, false);
+    se.limit      = limit;
+    se.best.found = false;
+
+    Node root;
+    std::memset(&root, 0, sizeof(root));
+
+    std::vector<Node> frontier;
+    run(se, root, &frontier);
+
+    const auto start = std::chrono::steady_clock::now();
+    std::atomic<std::size_t> next{0};
+    std::atomic<std::size_t> done{0};
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; t++)
+        pool.emplace_back(worker, std::ref(se), std::cref(frontier), std::ref(next), std::ref(done));
+
+    // progress report, until every sub search has been handed out and
+    // finished. Polled more often than it is printed, so that the many
+    // budgets that finish at once don't each wait out a whole report.
+    auto reported = start;
+    while (done < frontier.size() && !se.timed_out)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        const auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<double>(now - reported).count() < REPORT_SECS)
+            continue;
+        reported = now;
+        bool found;
+        {
+            // workers update best under the lock while this runs
+            std::lock_guard<std::mutex> lock(se.best_lock);
+            found = se.best.found;
+        }
+        std::cerr << "\r  " << std::setw(2) << words << " words: [" << std::fixed << std::setprecision(1)
+                  << std::setw(5) << 100.0 * done / frontier.size() << "%] " << done << "/" << frontier.size()
+                  << " sub searches, " << se.nodes.load() << " branches so far, "
+                  << std::chrono::duration<double>(now - start).count() << "s" << (found ? ", found" : "")
+                  << "     " << std::flush;
+    }
+    for (auto &t : pool)
+        t.join();
+}
+
+struct Trace
+{
+    std::vector<std::uint8_t> outs;
+    std::uint64_t             clks;
+    bool                      halt;
+    std::uint16_t             fetched; // words executed as instructions
+    std::uint16_t             touched; // words read or written at all
+};
+
+static Trace trace_program(const std::uint8_t image[RAM_DEPTH], std::uint64_t max_clks)
+{
+    Trace t{};
+    Sap1_State s;
+    std::memset(&s, 0, sizeof(s));
+    std::copy(image, image + RAM_DEPTH, s.ram);
+    while (t.clks < max_clks)
+    {
+        const std::uint32_t cw = control_word(s);
+        if (cw & (CW_RO | CW_RI))
+            t.touched |= 1 << s.mar;
+        if ((cw & CW_II) && s.step == 1)
+            t.fetched |= 1 << s.mar;
+        if (cw & CW_HLT)
+        {
+            t.halt = true;
+            break;
+        }
+        if (cw & CW_OI)
+            t.outs.push_back(bus(s, cw));
+        clock_edge(s, cw);
+        t.clks++;
+    }
+    return t;
+}
+
+static int words_used(std::uint16_t touched)
+{
+    int words = 0;
+    for (int i = 0; i < RAM_DEPTH; i++)
+        if ((touched >> i) & 1)
+            words = i + 1;
+    return words;
+}
+
+// Cost of a program under the chosen objective: (words, clks), or with
+// min_clks (clks, words). Lower is better.
+static std::pair<std::uint64_t, std::uint64_t> cost(const Trace &t, bool min_clks)
+{
+    const std::uint64_t words = words_used(t.touched);
+    return min_clks ? std::make_pair(t.clks, words) : std::make_pair(words, t.clks);
+}
+
+// Deletes count words at addr, moving everything after it down, and fixes
+// up address operands to match. Anything that pointed into the deleted
+// words now points at whatever follows them. Data words are fixed up too
+// if they happen to look like such an instruction -- whether that was
+// right is for the caller to find out by running it.
+static void delete_words(std::uint8_t image[RAM_DEPTH], int addr, int count)
+{
+    std::copy(image + addr + count, image + RAM_DEPTH, image + addr);
+    std::fill(image + RAM_DEPTH - count, image + RAM_DEPTH, 0);
+    for (int i = 0; i < RAM_DEPTH; i++)
+    {
+        const Opcode_Entry &e = lookup_opcode(image[i] >> ARG_BITS);
+        if (!e.argument || !operand_is_address(e))
+            continue;
+        const int arg = image[i] & ARGUMENT_MASK;
+        const int fixed = arg >= addr + count ? arg - count : arg >= addr ? addr : arg;
+        image[i] = (image[i] & ~ARGUMENT_MASK) | fixed;
+    }
+}
+
+// Greedy local search, starting from the input program itself: keep
+// deleting words, or rewriting one word, for as long as that still gives
+// the same Out sequence at a lower cost. This is what gets a full size
+// program down to something the exhaustive search can hope to beat, and
+// cleans up the obvious waste (a LDA right after a STA of the same word,
+// for example) in no time at all.
+static void shrink(std::uint8_t image[RAM_DEPTH], const Trace &orig, std::uint64_t max_clks, bool min_clks)
+{
+    const std::vector<std::uint8_t> values = candidate_values(RAM_DEPTH, true);
+    Trace best = trace_program(image, max_clks);
+
+    auto accept = [&](const std::uint8_t candidate[RAM_DEPTH])
+    {
+        const Trace t = trace_program(candidate, max_clks);
+        if (!t.halt || t.outs != orig.outs || cost(t, min_clks) >= cost(best, min_clks))
+            return false;
+        std::copy(candidate, candidate + RAM_DEPTH, image);
+        best = t;
+        return true;
+    };
+
+    bool improved = true;
+    while (improved)
+    {
+        improved = false;
+        for (int count = 1; count <= 2 && !improved; count++)
+        for (int addr = 0; addr + count <= RAM_DEPTH && !improved; addr++)
+        {
+            std::uint8_t candidate[RAM_DEPTH];
+            std::copy(image, image + RAM_DEPTH, candidate);
+            delete_words(candidate, addr, count);
+            improved = accept(candidate);
+        }
+        for (int addr = 0; addr < RAM_DEPTH && !improved; addr++)
+        for (std::size_t v = 0; v < values.size() && !improved; v++)
+        {
+            std::uint8_t candidate[RAM_DEPTH];
+            std::copy(image, image + RAM_DEPTH, candidate);
+            candidate[addr] = values[v];
+            improved = candidate[addr] != image[addr] && accept(candidate);
+        }
+    }
+}
+
+static bool read_hex(const std::string &path, std::uint8_t image[RAM_DEPTH])
+{
+    std::ifstream f(path);
+    if (!f)
+        return false;
+    std::fill(image, image + RAM_DEPTH, 0);
+    unsigned v;
+    for (int i = 0; i < RAM_DEPTH && f >> std::hex >> v; i++)
+        image[i] = v;
+    return true;
+}
+
+static std::string format_outs(const std::vector<std::uint8_t> &outs)
+{
+    std::ostringstream os;
+    for (std::size_t i = 0; i < outs.size(); i++)
+        os << (i ? " " : "") << int(outs[i]);
+    return os.str();
+}
+
+static void write_asm(std::ostream &os, const std::uint8_t image[RAM_DEPTH], int words,
+                      const Trace &t, const std::string &input, const Trace &orig, int orig_words)
+{
+    os << "; Superoptimized from " << input << ": " << words << " words / " << t.clks << " clks"
+       << " (was " << orig_words << " words / " << orig.clks << " clks)\n"
+       << "; Out: " << format_outs(t.outs) << "\n";
+    for (int i = 0; i < words; i++)
+    {
+        const Opcode_Entry &e = lookup_opcode(image[i] >> ARG_BITS);
+        std::ostringstream line;
+        line << "  " << e.name;
+        if (e.argument)
+            line << " " << int(image[i] & ARGUMENT_MASK);
+        os << std::left << std::setw(12) << line.str() << std::right << "; " << std::setw(2) << i << ": "
+           << (((t.fetched >> i) & 1) ? ((t.touched & ~t.fetched) >> i & 1 ? "code, data" : "code")
+                                      : ((t.touched >> i) & 1) ? "data" : "unused")
+           << "\n";
+    }
+}
+
+static void usage(const char *argv0)
+{
+    std::cerr << "Usage: " << argv0 << " -i INPUT_HEX [-o OUTPUT_ASM] [-c] [-j THREADS] [-m MAX_CLKS] [-t SECONDS]\n"
+              << "  -i  assembled program to shrink (ram.hex format). Required\n"
+              << "  -o  file to write the result to as assembler source. Defaults to stdout\n"
+              << "  -c  minimize clocks to HLT instead of RAM words\n"
+              << "  -j  worker threads. Defaults to all cores\n"
+              << "  -m  most clocks a smaller program may take to HLT. Defaults to twice the input's\n"
+              << "  -t  give up after this many seconds, and report the best found so far. Defaults to "
+              << DEFAULT_SECONDS << ", 0 for no limit" << std::endl;
+}
+
+int main(int argc, char**argv)
+{
+    std::string input;
+    std::string output;
+    bool        min_clks = false;
+    int         threads  = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    std::uint64_t max_clks = 0;
+    double      seconds  = DEFAULT_SECONDS;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:o:cj:m:t:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'i': input    = optarg;                   break;
+            case 'o': output   = optarg;                   break;
+            case 'c': min_clks = true;                     break;
+            case 'j': threads  = std::atoi(optarg);        break;
+            case 'm': max_clks = std::atoll(optarg);       break;
+            case 't': seconds  = std::atof(optarg);        break;
+            default : usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (input == "")
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (threads < 1)
+    {
+        std::cerr << "Error:   -j must be a number of at least 1" << std::endl;
+        return 1;
+    }
+
+    std::uint8_t image[RAM_DEPTH];
+    if (!read_hex(input, image))
+    {
+        std::cerr << "Error:   Could not read " << input << std::endl;
+        return 1;
+    }
+    const Trace orig       = trace_program(image, MAX_INPUT_CLKS);
+    const int   orig_words = words_used(orig.touched);
+    if (!orig.halt)
+    {
+        std::cerr << "Error:   " << input << " did not hit a HLT within " << MAX_INPUT_CLKS << " clks" << std::endl;
+        return 1;
+    }
+    std::cerr << input << ": " << orig_words << " words / " << orig.clks << " clks, Out: "
+              << format_outs(orig.outs) << std::endl;
+    if (max_clks == 0)
+        max_clks = 2 * orig.clks;
+
+    std::uint8_t best[RAM_DEPTH];
+    std::copy(image, image + RAM_DEPTH, best);
+    shrink(best, orig, max_clks, min_clks);
+    const Trace local = trace_program(best, max_clks);
+    std::cerr << "Local search: " << words_used(local.touched) << " words / " << local.clks << " clks" << std::endl;
+
+    Search se;
+    se.expected     = orig.outs;
+    se.has_deadline = seconds > 0;
+    se.deadline     = std::chrono::steady_clock::now() +
+                      std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+
+    // Then the exhaustive search, for anything that beats it
+    const auto start = std::chrono::steady_clock::now();
+    auto report = [&](int words)
+    {
+        const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cerr << "\r  " << std::setw(2) << words << " words: " << std::setw(14) << se.nodes.load()
+                  << " branches so far, " << std::fixed << std::setprecision(1) << secs << "s"
+                  << (se.best.found ? ", found" : "") << std::string(24, ' ') << std::endl;
+    };
+    if (min_clks)
+    {
+        // a faster program may well need more words than the input, so
+        // this one gets all of RAM to work with
+        search(se, RAM_DEPTH, local.clks - 1, threads);
+        report(RAM_DEPTH);
+    }
+    else
+    {
+        // smallest budget first, so the first one with any solution is the
+        // fewest words possible -- that search still runs to completion so
+        // the result is also the fastest program of that size
+        for (int words = 1; words < words_used(local.touched) && !se.timed_out; words++)
+        {
+            search(se, words, max_clks, threads);
+            report(words);
+            if (se.best.found)
+                break;
+        }
+    }
+    if (se.timed_out)
+        std::cerr << "Warning: Out of time, the exhaustive search is incomplete and the result may not be optimal" << std::endl;
+    if (se.best.found)
+        std::copy(se.best.image, se.best.image + RAM_DEPTH, best);
+
+    // Shouldn't be possible -- but the output had better be right
+    const Trace t = trace_program(best, max_clks);
+    if (!t.halt || t.outs != orig.outs)
+    {
+        std::cerr << "Error:   Found program does not reproduce the Out sequence" << std::endl;
+        return 3;
+    }
+    const int new_words = std::max(words_used(t.touched), 1);
+
+    std::ofstream f;
+    if (output != "")
+    {
+        f.open(output);
+        if (!f)
+        {
+            std::cerr << "Error:   Could not write " << output << std::endl;
+            return 1;
+        }
+    }
+    write_asm(output != "" ? static_cast<std::ostream&>(f) : std::cout,
+              best, new_words, t, input, orig, orig_words);
+    if (cost(t, min_clks) < cost(orig, min_clks))
+        std::cerr << "Found " << new_words << " words / " << t.clks << " clks (was "
+                  << orig_words << " words / " << orig.clks << " clks)" << std::endl;
+    else
+        std::cerr << "No smaller or faster equivalent program found" << std::endl;
+    return 0;
+}
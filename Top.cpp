@@ -3,16 +3,27 @@
 #include "verilated.h"
 #include "verilated_vcd_c.h"
 
+// Hash of everything that went into this bench (RTL, generated decoder,
+// opcodes.rb and this file), generated by the Makefile. Part of the result
+// cache key.
+#include "Model_Hash.h"
+
 #include <ncurses.h>
+#include <unistd.h>
 
 #include <cstdint>
 #include <cstdlib>
 
 #include <chrono>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 static constexpr int   MIN_ROWS         = 35;
 static constexpr int   MIN_COLS         = 80;
@@ -27,6 +38,25 @@ static constexpr int   COLOR_READ_FROM_INV  = 5;
 
 static double step_time_ms                  = 1000.0/20.0;
 
+// Must match FILE in Top.v
+static const std::string RAM_FILE           = "ram.hex";
+// Bump whenever the cache file format or what goes into the key changes
+static const std::string CACHE_VERSION      = "2";
+
+// Everything a non-gui, non-trace run reports: the Out register stream as
+// (clk, value) pairs, and how and when it stopped.
+struct Sim_Result
+{
+    bool halt;
+    std::uint64_t clk;
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> outs;
+
+    bool operator==(const Sim_Result &o) const
+    {
+        return halt == o.halt && clk == o.clk && outs == o.outs;
+    }
+};
+
 // each draw function needs the window, the dimensions of the widnow, and the data
 static void draw_main               (WINDOW*,int,int);
 static void draw_clk                (WINDOW*,int,int,
@@ -67,16 +97,167 @@ static inline char bool_to_c (bool in)
     return in ? '1' : '0';
 }
 
-static void tick ( int tickcount, VTop *tb,
-                   VerilatedVcdC *tfp )
+static bool read_file(const std::string &path, std::string &contents)
+{
+    std::ifstream f(path, std::ios::binary);
+    if (!f)
+        return false;
+    std::ostringstream ss;
+    ss << f.rdbuf();
+    contents = ss.str();
+    return true;
+}
+
+// 64 bit FNV-1a, chained through h
+static std::uint64_t hash_bytes(const std::string &bytes, std::uint64_t h = 0xcbf29ce484222325ULL)
+{
+    for (unsigned char c : bytes)
+    {
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// The simulation is deterministic given the program image, the model, and
+// MAX_STEPS, so those are all the key needs.
+static std::string cache_key(const std::string &image, std::uint64_t max_steps)
+{
+    std::uint64_t h = hash_bytes("SAP1 result cache v" + CACHE_VERSION);
+    h = hash_bytes(std::to_string(static_cast<std::uint64_t>(MODEL_HASH)), h);
+    h = hash_bytes(std::to_string(max_steps), h);
+    h = hash_bytes(image, h);
+    std::ostringstream ss;
+    ss << std::hex << std::setw(16) << std::setfill('0') << h;
+    return ss.str();
+}
+
+// Anything short of a whole record -- every out line the header promised,
+// then "end" -- is treated as a miss, and gets overwritten by a fresh run.
+static bool load_result(const std::string &path, Sim_Result &result)
+{
+    std::ifstream f(path);
+    std::string   tag;
+    std::size_t   count;
+    if (!(f >> tag) || tag != "halt" || !(f >> result.halt) ||
+        !(f >> tag) || tag != "clk"  || !(f >> result.clk)  ||
+        !(f >> tag) || tag != "outs" || !(f >> count))
+        return false;
+    result.outs.clear();
+    for (std::size_t i = 0; i < count; i++)
+    {
+        std::uint64_t clk;
+        std::uint64_t val;
+        if (!(f >> tag >> clk >> val) || tag != "out")
+            return false;
+        result.outs.emplace_back(clk, val);
+    }
+    return f >> tag && tag == "end" && !(f >> tag);
+}
+
+static bool store_result(const std::string &path, const Sim_Result &result)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+    // write then rename, so a concurrent reader never sees half a file
+    const std::string tmp = path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream f(tmp);
+        if (!f)
+            return false;
+        f << "halt " << result.halt        << "\n"
+          << "clk "  << result.clk         << "\n"
+          << "outs " << result.outs.size() << "\n";
+        for (const auto &o : result.outs)
+            f << "out " << o.first << " " << o.second << "\n";
+        f << "end\n";
+        // close() is what flushes it, so that is where a full disk shows up
+        f.close();
+        if (!f)
+        {
+            std::filesystem::remove(tmp, ec);
+            return false;
+        }
+    }
+    std::filesystem::rename(tmp, path, ec);
+    return !ec;
+}
+
+static void print_out_update(std::uint64_t out_data, std::uint64_t clk,
+                             bool had_out_in, std::uint64_t time_last_out_in)
+{
+    if (!had_out_in) {
+      std::cout << "Out Register update | hex: " << std::hex << std::setw(6) << out_data << " / dec: " << std::dec << std::setw(6) << out_data << " / clk " << std::setw(8) << clk << std::endl;
+    }
+    else {
+      std::cout << "Out Register update | hex: " << std::hex << std::setw(6) << out_data << " / dec: " << std::dec << std::setw(6) << out_data << " / clk " << std::setw(8) << clk << " (" << std::setw(8) << clk-time_last_out_in << " clks since last print)" << std::endl;
+    }
+}
+
+// return an error if we exited by infinite loop
+static int report_result(const Sim_Result &result)
+{
+    if (result.halt)
+    {
+        std::cerr << "Success: Simulation Terminated successfully at a HLT at clk " << result.clk << std::endl;
+        return 0;
+    }
+    std::cerr << "Error:   Simulation Terminated at clk " << result.clk << " without hitting a HLT!" << std::endl;
+    return 1;
+}
+
+// How tick() steps the model.
+//   TICK_EDGE  evaluates and dumps on both sides of both clock edges, so
+//              the waveform shows every edge where it happened. 4 evals
+//              and 4 dumps per clk.
+//   TICK_CYCLE evaluates only as often as the design needs. Everything is
+//              posedge triggered, so that is one eval to take the posedge,
+//              and one to bring clk back down so the next posedge is seen
+//              as an edge at all. 2 evals per clk, and a dump after each
+//              -- so clk still toggles in the waveform -- at the clk and
+//              half a clk later.
+enum Tick_Mode
+{
+    TICK_EDGE,
+    TICK_CYCLE
+};
+
+static std::uint64_t eval_count = 0;
+
+static inline void eval(VTop *tb)
 {
     tb->eval();
+    eval_count++;
+}
+
+static void tick_cycle ( int tickcount, VTop *tb,
+                         VerilatedVcdC *tfp )
+{
+    tb->clk = 1;
+    eval(tb);
+    if (tfp != nullptr)
+        tfp->dump(tickcount * 10);
+    tb->clk = 0;
+    eval(tb);
+    if (tfp != nullptr)
+        tfp->dump(tickcount * 10 + 5);
+}
+
+static void tick ( int tickcount, VTop *tb,
+                   VerilatedVcdC *tfp, Tick_Mode mode )
+{
+    if (mode == TICK_CYCLE)
+    {
+        tick_cycle(tickcount, tb, tfp);
+        return;
+    }
+    eval(tb);
     // log right before clock
     if (tfp != nullptr)
         tfp->dump(tickcount*10-0.0001);
-    tb->eval();
+    eval(tb);
     tb->clk = 1;
-    tb->eval();
+    eval(tb);
     // log at the posedge
     if (tfp != nullptr)
         tfp->dump(tickcount * 10);
@@ -87,7 +268,7 @@ static void tick ( int tickcount, VTop *tb,
         tfp->flush();
     }
     tb->clk  = 0;
-    tb->eval();
+    eval(tb);
     // log after negedge
     if (tfp != nullptr)
     {
@@ -103,6 +284,34 @@ int main(int argc, char**argv)
     const bool use_gui     = (GetEnv("USEGUI")     == "1") || (GetEnv("USE_GUI")     == "1");
     const std::string dp_f = (GetEnv("DUMP_F") != "") ? GetEnv("DUMP_F") : "top_trace.vcd";
     const std::uint64_t max_steps   = (GetEnv("MAX_STEPS") != "") ? std::atoll(GetEnv("MAX_STEPS").c_str()) : 3500000;
+    const bool bench_stats = (GetEnv("BENCH_STATS")  == "1");
+    // waveforms default to showing real edges; everything else to speed
+    const Tick_Mode tick_mode = (GetEnv("TICK_MODE") == "edge")  ? TICK_EDGE  :
+                                (GetEnv("TICK_MODE") == "cycle") ? TICK_CYCLE :
+                                dump_traces                      ? TICK_EDGE  : TICK_CYCLE;
+    const bool no_cache    = (GetEnv("NO_CACHE")     == "1");
+    const bool verify_cache= (GetEnv("VERIFY_CACHE") == "1");
+    const std::string cache_dir = (GetEnv("CACHE_DIR") != "") ? GetEnv("CACHE_DIR") : "sim_cache";
+
+    // Runs that only report the Out stream and how they ended are looked up
+    // in (and saved to) the result cache. GUI and trace runs are for
+    // watching the machine, and BENCH_STATS runs for timing the simulation
+    // itself, so they always simulate.
+    std::string program_image;
+    const bool use_cache   = !use_gui && !dump_traces && !bench_stats && !no_cache &&
+                             read_file(RAM_FILE, program_image);
+    const std::string cache_path = use_cache ? cache_dir + "/" + cache_key(program_image, max_steps) : "";
+    Sim_Result cached;
+    const bool cache_hit   = use_cache && load_result(cache_path, cached);
+    if (cache_hit && !verify_cache)
+    {
+        std::cerr << "Using cached result " << cache_path << " (set NO_CACHE=1 to re-simulate)" << std::endl;
+        for (std::size_t i = 0; i < cached.outs.size(); i++)
+            print_out_update(cached.outs[i].second, cached.outs[i].first,
+                             i != 0, i != 0 ? cached.outs[i-1].first : 0);
+        return report_result(cached);
+    }
+
     Verilated::commandArgs(argc,argv);
     VTop          *tb  = new VTop;
     if (tb == nullptr)
@@ -189,7 +398,8 @@ int main(int argc, char**argv)
     int exit           = 0;
 
     bool had_out_in = false;
-    std::uint64_t time_last_out_in;
+    std::uint64_t time_last_out_in = 0;
+    Sim_Result result;
 
 
     if (use_gui)
@@ -271,7 +481,7 @@ int main(int argc, char**argv)
     }
 
     tb->clk = 0;
-    tb->eval();
+    eval(tb);
     bool halt;
     bool adv;
     bool memaddri;
@@ -306,6 +516,7 @@ int main(int argc, char**argv)
 
 
     // capture variables in a loop - also do gui if needed
+    const auto sim_start = std::chrono::steady_clock::now();
     int k = 1;
     do
     {
@@ -339,14 +550,11 @@ int main(int argc, char**argv)
         b_reg               = tb->Top->get_b_reg();
         alu_data            = tb->Top->get_alu_data();
         out_data            = tb->Top->get_out_data();
-        if (oregi && !use_gui) {
-          if (!had_out_in) {
-            std::cout << "Out Register update | hex: " << std::hex << std::setw(6) << out_data << " / dec: " << std::dec << std::setw(6) << out_data << " / clk " << std::setw(8) << k-1 << std::endl;
-            had_out_in = true;
-          }
-          else {
-            std::cout << "Out Register update | hex: " << std::hex << std::setw(6) << out_data << " / dec: " << std::dec << std::setw(6) << out_data << " / clk " << std::setw(8) << k-1 << " (" << std::setw(8) << k-1-time_last_out_in << " clks since last print)" << std::endl;
-          }
+        if (oregi) {
+          result.outs.emplace_back(k-1, out_data);
+          if (!use_gui)
+            print_out_update(out_data, k-1, had_out_in, time_last_out_in);
+          had_out_in       = true;
           time_last_out_in = k-1;
         }
         oregi        = tb->Top->get_oregi();
@@ -433,10 +641,18 @@ int main(int argc, char**argv)
             draw_out_reg            (out_reg_win,out_reg_rows,out_reg_cols, oregi,
                     out_data);
         }
-        tick(k, tb, tfp);
+        tick(k, tb, tfp, tick_mode);
         k++;
     } while (k < max_steps && (halt!=1) && !exit);
 
+    if (bench_stats)
+    {
+        const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - sim_start).count();
+        std::cerr << "Stats:   " << (tick_mode == TICK_EDGE ? "edge" : "cycle") << " ticks, "
+                  << k-1 << " clks in " << secs << "s (" << std::fixed << std::setprecision(0) << (k-1)/secs << " clks/s), "
+                  << std::defaultfloat << eval_count << " evals (" << double(eval_count)/(k-1) << " per clk)" << std::endl;
+    }
+
     // if we exited by halting wait, if not quit immediately
     if (use_gui)
     {
@@ -455,17 +671,26 @@ int main(int argc, char**argv)
         endwin();
     }
 
-    // return an error if we exited by infinite loop
-    int exit_code;
-    if (halt == 1)
-    {
-        exit_code = 0;
-        std::cerr << "Success: Simulation Terminated successfully at a HLT at clk " << k-1 << std::endl;
-    }
-    else
+    result.halt = halt;
+    result.clk  = k-1;
+    int exit_code = report_result(result);
+
+    if (use_cache)
     {
-        exit_code = 1;
-        std::cerr << "Error:   Simulation Terminated at clk " << k-1 << " without hitting a HLT!" << std::endl;
+        if (!cache_hit)
+        {
+            if (!store_result(cache_path, result))
+                std::cerr << "Warning: Could not write result cache " << cache_path << std::endl;
+        }
+        else if (cached == result)
+        {
+            std::cerr << "Cached result " << cache_path << " matches this simulation" << std::endl;
+        }
+        else
+        {
+            std::cerr << "Error:   Cached result " << cache_path << " does not match this simulation!" << std::endl;
+            exit_code = 3;
+        }
     }
     if (tfp) tfp->close();
     delete tb;
@@ -346,6 +346,89 @@ module Top #(
       get_out_data = out_data;
     endfunction
 
+    function [RAM_WIDTH-1:0] get_ram;
+    // verilator public
+      input [ADDRESS_WIDTH-1:0] addr;
+      get_ram = inst_Ram.ram[addr];
+    endfunction
+
+    // Tasks to inject state from verilator, so a bench can start the
+    // machine from any state it likes rather than only from ram.hex (see
+    // Verify.cpp). Only built when SAP1_INJECT is defined -- the Makefile
+    // does that for the verify bench alone -- so the main bench's RTL has
+    // no writes to these regs outside of their own clocked blocks.
+    // Call eval() after injecting so the combinational logic settles on
+    // the new state before the next edge -- the bench must be Verilated
+    // with --public-flat-rw for eval() to notice these writes.
+    `ifdef SAP1_INJECT
+    /* verilator lint_off BLKANDNBLK */
+    task set_program_counter;
+    // verilator public
+      input [PROGRAM_COUNTER_WIDTH-1:0] val;
+      inst_Program_Counter.counter = val;
+    endtask
+
+    task set_instruction_counter;
+    // verilator public
+      input [INSTRUCTION_COUNTER_WIDTH-1:0] val;
+      inst_Instruction_Counter.counter = val;
+    endtask
+
+    task set_instruction_reg;
+    // verilator public
+      input [INSTRUCTION_REGISTER_WIDTH-1:0] val;
+      inst_Register_Instruction.o_data = val;
+    endtask
+
+    task set_memory_address;
+    // verilator public
+      input [ADDRESS_WIDTH-1:0] val;
+      inst_Register_Memory_Address.o_data = val;
+    endtask
+
+    task set_ram;
+    // verilator public
+      input [ADDRESS_WIDTH-1:0] addr;
+      input     [RAM_WIDTH-1:0] val;
+      inst_Ram.ram[addr] = val;
+    endtask
+
+    task set_a_reg;
+    // verilator public
+      input [A_REG_WIDTH-1:0] val;
+      inst_Register_A.o_data = val;
+    endtask
+
+    task set_b_reg;
+    // verilator public
+      input [B_REG_WIDTH-1:0] val;
+      inst_Register_B.o_data = val;
+    endtask
+
+    task set_zero;
+    // verilator public
+      input val;
+      inst_ALU.o_zero = val;
+    endtask
+    task set_carry;
+    // verilator public
+      input val;
+      inst_ALU.o_carry = val;
+    endtask
+    task set_odd;
+    // verilator public
+      input val;
+      inst_ALU.o_odd = val;
+    endtask
+
+    task set_out_data;
+    // verilator public
+      input [OUT_WIDTH-1:0] val;
+      inst_Out.o_data = val;
+    endtask
+    /* verilator lint_on BLKANDNBLK */
+    `endif
+
   `endif
 
 endmodule
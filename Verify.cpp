@@ -0,0 +1,345 @@
+// Exhaustive single instruction verification of the RTL.
+//
+// For every opcode, operand, A, B and flag state (and, for instructions that
+// read RAM, every value of the addressed RAM byte) this injects that state
+// into the Verilated model, runs exactly one instruction, and compares the
+// whole machine state afterwards -- and the number of clocks it took --
+// against Reference_Model.h, which runs the same microcode out of
+// opcodes.rb without any of the RTL.
+//
+// The sweep is split up by (opcode, operand, A) and handed out to one
+// model per thread. Each thread gets its own VerilatedContext, so they
+// share nothing.
+//
+// Environment variables:
+//   VERIFY_THREADS  number of worker threads (default: all cores)
+//   VERIFY_FULL     "1" to sweep the addressed RAM byte for every opcode,
+//                   not just the ones whose microcode reads RAM
+
+#include "VTop.h"
+#include "VTop_Top.h"
+#include "verilated.h"
+
+#include "Reference_Model.h"
+
+#include <cstdint>
+#include <cstdlib>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+static constexpr int          NUM_OPERANDS   = 1 << ARG_BITS;
+static constexpr int          NUM_OPCODE_IDS = 256 / NUM_OPERANDS;
+static constexpr int          NUM_UNITS      = NUM_OPCODE_IDS * NUM_OPERANDS * 256; // opcode x operand x A
+static constexpr int          MAX_REPORTED   = 10;
+static constexpr double       REPORT_SECS    = 1.0;
+
+// Filler for the RAM words an instruction shouldn't touch, so a stray
+// write or read shows up as a mismatch.
+static constexpr std::uint8_t RAM_BACKGROUND = 0xa5;
+
+static std::string GetEnv(const std::string &var)
+{
+    const char* val = std::getenv(var.c_str());
+    return val==nullptr ? "" : std::string(val);
+}
+
+// Same as tick_cycle() in Top.cpp, minus the traces: everything is posedge
+// triggered, so the negedge is only there so the next posedge is an edge.
+static void tick(VTop *tb)
+{
+    tb->clk = 1;
+    tb->eval();
+    tb->clk = 0;
+    tb->eval();
+}
+
+static void inject(VTop *tb, const Sap1_State &s)
+{
+    tb->Top->set_program_counter    (s.pc);
+    tb->Top->set_instruction_counter(s.step);
+    tb->Top->set_instruction_reg    (s.ir);
+    tb->Top->set_memory_address     (s.mar);
+    tb->Top->set_a_reg              (s.a);
+    tb->Top->set_b_reg              (s.b);
+    tb->Top->set_out_data           (s.out);
+    tb->Top->set_zero               (s.zero);
+    tb->Top->set_carry              (s.carry);
+    tb->Top->set_odd                (s.odd);
+    for (int i = 0; i < RAM_DEPTH; i++)
+        tb->Top->set_ram(i, s.ram[i]);
+    tb->eval();
+}
+
+static Sap1_State sample(VTop *tb)
+{
+    Sap1_State s;
+    s.pc    = tb->Top->get_program_counter();
+    s.step  = tb->Top->get_instruction_counter();
+    s.ir    = tb->Top->get_instruction_reg();
+    s.mar   = tb->Top->get_memory_address();
+    s.a     = tb->Top->get_a_reg();
+    s.b     = tb->Top->get_b_reg();
+    s.out   = tb->Top->get_out_data();
+    s.zero  = tb->Top->get_zero();
+    s.carry = tb->Top->get_carry();
+    s.odd   = tb->Top->get_odd();
+    for (int i = 0; i < RAM_DEPTH; i++)
+        s.ram[i] = tb->Top->get_ram(i);
+    return s;
+}
+
+// Same stopping rule as run_instruction() in Reference_Model.h
+static int run_instruction(VTop *tb, bool *halted)
+{
+    int clks = 0;
+    *halted = false;
+    do
+    {
+        if (tb->Top->get_halt())
+        {
+            *halted = true;
+            break;
+        }
+        tick(tb);
+        clks++;
+    } while (tb->Top->get_instruction_counter() != 0 && clks <= INSTRUCTION_STEPS);
+    return clks;
+}
+
+// The state every case starts from: at step 0, about to fetch (opcode,
+// operand) from pc. pc is kept off of the operand's address so that the
+// instruction and the byte it addresses are separate words.
+static Sap1_State start_state(int opcode, int operand, int a, int b, int flags, int ram_byte)
+{
+    Sap1_State s;
+    s.pc    = (operand + 1) & ADDRESS_MASK;
+    s.step  = 0;
+    s.ir    = 0;
+    s.mar   = 0;
+    s.a     = a;
+    s.b     = b;
+    s.out   = ~a;
+    s.zero  = flags & 1;
+    s.carry = flags & 2;
+    s.odd   = flags & 4;
+    for (int i = 0; i < RAM_DEPTH; i++)
+        s.ram[i] = RAM_BACKGROUND ^ i;
+    s.ram[operand] = ram_byte;
+    s.ram[s.pc]    = (opcode << ARG_BITS) | operand;
+    return s;
+}
+
+static bool reads_ram(const Opcode_Entry &e)
+{
+    // steps 0 and 1 are the fetch, which reads the instruction itself
+    for (int i = 2; i < INSTRUCTION_STEPS; i++)
+        if ((e.steps[i].ctrl | e.steps[i].cond_ctrl) & CW_RO)
+            return true;
+    return false;
+}
+
+static std::string format_state(const Sap1_State &s)
+{
+    std::ostringstream os;
+    os << std::hex << std::setfill('0')
+       << "pc "    << std::setw(1) << int(s.pc)
+       << " step " << std::setw(1) << int(s.step)
+       << " ir "   << std::setw(2) << int(s.ir)
+       << " mar "  << std::setw(1) << int(s.mar)
+       << " a "    << std::setw(2) << int(s.a)
+       << " b "    << std::setw(2) << int(s.b)
+       << " out "  << std::setw(2) << int(s.out)
+       << " zco "  << s.zero << s.carry << s.odd
+       << " ram";
+    for (int i = 0; i < RAM_DEPTH; i++)
+        os << ' ' << std::setw(2) << int(s.ram[i]);
+    return os.str();
+}
+
+struct Sweep
+{
+    bool                       full;
+    std::atomic<int>           next_unit{0};
+    std::atomic<std::uint64_t> cases{0};
+    std::atomic<std::uint64_t> mismatches{0};
+    std::atomic<std::uint64_t> opcode_cases[NUM_OPCODE_IDS]      = {};
+    std::atomic<std::uint64_t> opcode_mismatches[NUM_OPCODE_IDS] = {};
+    std::mutex                 report_lock;
+    std::atomic<bool>          error{false};
+};
+
+static void report_mismatch(Sweep &sw, const Sap1_State &start,
+                            const Sap1_State &expected, int expected_clks, bool expected_halt,
+                            const Sap1_State &actual,   int actual_clks,   bool actual_halt)
+{
+    if (sw.mismatches++ >= MAX_REPORTED)
+        return;
+    std::lock_guard<std::mutex> lock(sw.report_lock);
+    std::cerr << "\nMismatch on " << lookup_opcode(start.ram[start.pc] >> ARG_BITS).name
+              << " (" << std::hex << std::setfill('0') << std::setw(2) << int(start.ram[start.pc])
+              << std::dec << std::setfill(' ') << ")\n"
+              << "  start:    " << format_state(start) << "\n"
+              << "  expected: " << format_state(expected) << " | " << expected_clks << " clks" << (expected_halt ? ", halted" : "") << "\n"
+              << "  actual:   " << format_state(actual)   << " | " << actual_clks   << " clks" << (actual_halt   ? ", halted" : "") << std::endl;
+}
+
+static void worker(Sweep &sw)
+{
+    std::unique_ptr<VerilatedContext> ctx{new VerilatedContext};
+    std::unique_ptr<VTop>             tb {new VTop{ctx.get()}};
+    tb->clk = 0;
+    tb->eval();
+
+    // Make sure that injected state actually reaches the combinational
+    // logic -- on step 0 the program counter is driven onto the bus -- so a
+    // model that doesn't settle fails loudly here, instead of as a flood of
+    // bogus mismatches below.
+    for (int pc : {0x5, 0xa})
+    {
+        Sap1_State s = start_state(0, 0, 0, 0, 0, 0);
+        s.pc = pc;
+        inject(tb.get(), s);
+        if (tb->Top->get_bus_out() != std::uint64_t(pc))
+        {
+            std::lock_guard<std::mutex> lock(sw.report_lock);
+            if (!sw.error)
+                std::cerr << "Error:   Injected state did not propagate through the model (bus "
+                          << tb->Top->get_bus_out() << ", expected " << pc << ")" << std::endl;
+            sw.error = true;
+            sw.next_unit = NUM_UNITS;
+            return;
+        }
+    }
+
+    int unit;
+    while ((unit = sw.next_unit++) < NUM_UNITS)
+    {
+        const int opcode  = unit / (NUM_OPERANDS * 256);
+        const int operand = (unit / 256) % NUM_OPERANDS;
+        const int a       = unit % 256;
+        const int ram_values = (sw.full || reads_ram(lookup_opcode(opcode))) ? 256 : 1;
+
+        std::uint64_t unit_cases      = 0;
+        std::uint64_t unit_mismatches = 0;
+        for (int b = 0; b < 256; b++)
+        for (int flags = 0; flags < 8; flags++)
+        for (int r = 0; r < ram_values; r++)
+        {
+            const std::uint8_t ram_byte = ram_values == 1 ? RAM_BACKGROUND ^ operand : r;
+            const Sap1_State start = start_state(opcode, operand, a, b, flags, ram_byte);
+
+            Sap1_State expected = start;
+            bool       expected_halt;
+            const int  expected_clks = run_instruction(expected, &expected_halt);
+
+            inject(tb.get(), start);
+            bool       actual_halt;
+            const int  actual_clks = run_instruction(tb.get(), &actual_halt);
+            const Sap1_State actual = sample(tb.get());
+
+            unit_cases++;
+            if (actual != expected || actual_clks != expected_clks || actual_halt != expected_halt)
+            {
+                unit_mismatches++;
+                report_mismatch(sw, start, expected, expected_clks, expected_halt,
+                                       actual,   actual_clks,   actual_halt);
+            }
+        }
+        sw.cases                     += unit_cases;
+        sw.opcode_cases[opcode]      += unit_cases;
+        sw.opcode_mismatches[opcode] += unit_mismatches;
+    }
+}
+
+static std::uint64_t total_cases(bool full)
+{
+    std::uint64_t n = 0;
+    for (int opcode = 0; opcode < NUM_OPCODE_IDS; opcode++)
+        n += std::uint64_t(NUM_OPERANDS) * 256 * 256 * 8 *
+             ((full || reads_ram(lookup_opcode(opcode))) ? 256 : 1);
+    return n;
+}
+
+static std::string format_secs(double secs)
+{
+    std::ostringstream os;
+    const long s = static_cast<long>(secs);
+    if (s >= 60)
+        os << s / 60 << "m";
+    os << s % 60 << "s";
+    return os.str();
+}
+
+int main(int argc, char**argv)
+{
+    Verilated::commandArgs(argc,argv);
+    const bool     full    = GetEnv("VERIFY_FULL") == "1";
+    const int      threads = (GetEnv("VERIFY_THREADS") != "") ? std::atoi(GetEnv("VERIFY_THREADS").c_str())
+                                                              : static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    if (threads < 1)
+    {
+        std::cerr << "Error:   VERIFY_THREADS must be a number of at least 1" << std::endl;
+        return 1;
+    }
+    const std::uint64_t total = total_cases(full);
+
+    Sweep sw;
+    sw.full = full;
+
+    std::cerr << "Verifying " << total << " single instruction cases on " << threads << " threads"
+              << (full ? " (full RAM sweep)" : "") << std::endl;
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    for (int i = 0; i < threads; i++)
+        pool.emplace_back(worker, std::ref(sw));
+
+    // progress report, until every unit has been handed out and finished
+    while (sw.cases < total && !sw.error)
+    {
+        std::this_thread::sleep_for(std::chrono::duration<double>(REPORT_SECS));
+        const double        secs  = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const std::uint64_t done  = sw.cases;
+        const double        rate  = done / secs;
+        std::lock_guard<std::mutex> lock(sw.report_lock);
+        std::cerr << "\r[" << std::fixed << std::setprecision(1) << std::setw(5) << 100.0 * done / total << "%] "
+                  << done << " cases, " << std::setprecision(2) << rate / 1e6 << "M cases/s, ETA "
+                  << (rate > 0 ? format_secs((total - done) / rate) : "?") << "     " << std::flush;
+    }
+    for (auto &t : pool)
+        t.join();
+    const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << std::endl;
+
+    if (sw.error)
+        return 2;
+
+    for (int opcode = 0; opcode < NUM_OPCODE_IDS; opcode++)
+    {
+        const Opcode_Entry &e = lookup_opcode(opcode);
+        std::cout << std::hex << std::setfill('0') << "0x" << std::setw(2) << opcode
+                  << std::dec << std::setfill(' ') << " " << std::setw(5) << std::left
+                  << (e.opcode == opcode ? e.name : "(NOP)") << std::right
+                  << std::setw(12) << sw.opcode_cases[opcode] << " cases, "
+                  << sw.opcode_mismatches[opcode] << " mismatches" << std::endl;
+    }
+
+    if (sw.mismatches != 0)
+    {
+        std::cerr << "Error:   " << sw.mismatches << " of " << sw.cases.load() << " cases did not match opcodes.rb ("
+                  << format_secs(secs) << ")" << std::endl;
+        return 1;
+    }
+    std::cerr << "Success: All " << sw.cases.load() << " cases matched opcodes.rb (" << format_secs(secs) << ")" << std::endl;
+    return 0;
+}
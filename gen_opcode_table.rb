@@ -0,0 +1,58 @@
+#!/usr/bin/env ruby
+# Renders Opcode_Table.h from Opcode_Table.h.erb + opcodes.rb, so the C++
+# side (Reference_Model.h, and the benches/tools built on it) reads its
+# microcode from the same source of truth as the assembler and the decoder.
+#
+#   ./gen_opcode_table.rb [output_path]
+#
+# output_path defaults to Opcode_Table.h next to this script.
+#
+# Control line bit positions are read out of control_words.vi rather than
+# restated here, so the C++ CW_* masks are bit-for-bit the RTL's c_* words.
+
+require 'erb'
+require_relative 'opcodes'
+
+CONTROL_WORDS_PATH = File.join(__dir__, 'control_words.vi')
+
+def control_positions
+  File.read(CONTROL_WORDS_PATH).scan(/localparam\s+(\w+)_POS\s*=\s*(\d+);/)
+      .map { |name, pos| [name.to_sym, pos.to_i] }
+      .sort_by { |_, pos| -pos }
+end
+
+def render_ctrl(ctrl)
+  return '0' if ctrl.empty?
+
+  ctrl.map { |c| "CW_#{c}" }.join(' | ')
+end
+
+def render_step(data)
+  return '{ 0, FLAG_NONE, 0 }' if data.nil?
+  return "{ #{render_ctrl(data[:ctrl])}, FLAG_NONE, 0 }" unless data[:cond]
+
+  "{ #{render_ctrl(data[:ctrl])}, FLAG_#{data[:cond][:flag].upcase}, #{render_ctrl(data[:cond][:ctrl])} }"
+end
+
+table     = expand_opcode_table(OPCODE_TABLE)
+positions = control_positions
+raise "no control lines found in #{CONTROL_WORDS_PATH}" if positions.empty?
+
+table.each_with_index do |e, i|
+  # lookup_opcode() in the template indexes the table directly by opcode.
+  raise "#{e[:name]}: opcode #{e[:opcode]} is not its table index #{i}" unless e[:opcode] == i
+end
+
+known = positions.map(&:first)
+table.each do |e|
+  e[:steps].each_value do |s|
+    unknown = s[:ctrl] + (s[:cond] ? s[:cond][:ctrl] : []) - known
+    raise "#{e[:name]}: control line(s) #{unknown.join(', ')} not defined in control_words.vi" unless unknown.empty?
+  end
+end
+
+template_path = File.join(__dir__, 'Opcode_Table.h.erb')
+output_path   = ARGV[0] || File.join(__dir__, 'Opcode_Table.h')
+
+erb = ERB.new(File.read(template_path), trim_mode: '-')
+File.write(output_path, erb.result(binding))
@@ -5,6 +5,8 @@
 #   * assembler.rb requires this file directly to build its OPS table.
 #   * gen_decoder.rb requires this file to render Instruction_Decoder.v.erb
 #     into Instruction_Decoder.v.
+#   * gen_opcode_table.rb requires this file to render Opcode_Table.h.erb
+#     into Opcode_Table.h, the microcode that Reference_Model.h runs.
 # Note that changes to this file require re-assembling
 #
 # Instructions are described as having multiple steps, IE "microcode"